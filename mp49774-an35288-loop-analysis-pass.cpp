@@ -5,62 +5,115 @@
 
 using namespace llvm;
 
-LoopPropertiesAnalysis::LoopProperties::LoopProperties(
-    const LoopInfo &LI, const Loop *L, 
-    unsigned int LID, StringRef FName) {
-  int numInstr = 0;
-  int numAtomics = 0;
-  int numBranches = 0;
-  int numBasicBlocks = L->getNumBlocks();
-
-  // Calling loop.getNumBlocks isn't enough because this function doesn't
-  // differentiate between blocks inside nested loops and blocks that are
-  // only in the top level loop
-  bool isInnerLoopBlock = false;
-
-  for (auto &BB : L->blocks()) {
-    // per the assignment specifications, we don't want to count basic blocks 
-    // from nested loops/children of this current loop
-    if (LI.getLoopDepth(BB) > L->getLoopDepth()) {
-      isInnerLoopBlock = true;
-      numBasicBlocks--;
-    }
-    else {
-      isInnerLoopBlock = false;
-    }
+// Opcode -> class lookup table, filled in once. Instruction opcodes are small
+// consecutive integers (see llvm/IR/Instruction.def), so a flat array is all
+// we need.
+static BlockSummaryAnalysis::OpcodeClass classifyOpcode(unsigned Op) {
+  if (Op == Instruction::Br) {
+    return BlockSummaryAnalysis::Branch;
+  }
+  if ((Op >= Instruction::BinaryOpsBegin && Op < Instruction::BinaryOpsEnd) ||
+      (Op >= Instruction::CastOpsBegin && Op < Instruction::CastOpsEnd) ||
+      Op == Instruction::Select || Op == Instruction::GetElementPtr) {
+    return BlockSummaryAnalysis::Hoistable;
+  }
+
+  switch (Op) {
+  case Instruction::Call:
+  case Instruction::Invoke:
+  case Instruction::CallBr:
+    return BlockSummaryAnalysis::Call;
+  case Instruction::Load:
+  case Instruction::Store:
+  case Instruction::AtomicRMW:
+  case Instruction::AtomicCmpXchg:
+  case Instruction::Fence:
+    return BlockSummaryAnalysis::Memory;
+  case Instruction::PHI:
+    return BlockSummaryAnalysis::Phi;
+  default:
+    return BlockSummaryAnalysis::Other;
+  }
+}
 
-    // turns out BB->getNumInstr does not exist (pain) so now I'm gonna iterate
-    // over all the instructions in the basic block like a little fool
+static const auto OpcodeClasses = [] {
+  std::array<BlockSummaryAnalysis::OpcodeClass, Instruction::OtherOpsEnd> Table;
+  for (unsigned Op = 0; Op < Table.size(); Op++) {
+    Table[Op] = classifyOpcode(Op);
+  }
+  return Table;
+}();
 
-    for (auto &I : *BB) {
-      numInstr++;
+BlockSummaryAnalysis::OpcodeClass 
+BlockSummaryAnalysis::classOf(const Instruction &I) {
+  return OpcodeClasses[I.getOpcode()];
+}
 
-      // But, we can't get the number of atomics without iterating through all
-      // instructions in the loop anyways
-      if (I.isAtomic()) {
-        numAtomics++;
-      }
+const BlockSummaryAnalysis::BlockSummary &
+BlockSummaryAnalysis::Result::get(const BasicBlock *BB) const {
+  static const BlockSummary Empty;
+
+  auto found = Blocks.find(BB);
+  assert(found != Blocks.end() && "block added after the summary was built");
+  return found != Blocks.end() ? found->second : Empty;
+}
 
-      // Same as with num Basic Blocks -- don't want to count branch instrs
-      // from the nested loops
-      if (!isInnerLoopBlock) {
-        if (isa<BranchInst>(I)) {
-          numBranches++;
-        }
+void BlockSummaryAnalysis::Result::moveInstruction(const Instruction &I,
+                                                   const BasicBlock *From,
+                                                   const BasicBlock *To) {
+  auto C = classOf(I);
+  int atomic = I.isAtomic() ? 1 : 0;
+
+  // One block at a time, looking up the second one can grow the map and
+  // move the first one around
+  auto &Src = Blocks[From];
+  Src.instrs--;
+  Src.classes[C]--;
+  Src.kinds[C] = Src.classes[C] > 0;
+  Src.atomics -= atomic;
+
+  auto &Dst = Blocks[To];
+  Dst.instrs++;
+  Dst.classes[C]++;
+  Dst.kinds[C] = true;
+  Dst.atomics += atomic;
+}
+
+BlockSummaryAnalysis::Result 
+BlockSummaryAnalysis::run(Function &F, FunctionAnalysisManager &) {
+  Result R;
+  R.Blocks.reserve(F.size());
+
+  for (auto &BB : F) {
+    auto &S = R.Blocks[&BB];
+    for (auto &I : BB) {
+      S.instrs++;
+      auto C = classOf(I);
+      S.classes[C]++;
+      S.kinds[C] = true;
+      if (I.isAtomic()) {
+        S.atomics++;
       }
     }
   }
 
+  return R;
+}
+
+AnalysisKey BlockSummaryAnalysis::Key;
+
+LoopPropertiesAnalysis::LoopProperties::LoopProperties(
+    const Loop *L, const LoopTotals &T, unsigned int LID, StringRef FName) {
   id = LID; 
   func = FName;
   // We do loop depth minus 1 because part 1 tells us that loop depth is supposed
   // to go from 0, and by default, getLoopDepth returns 1 for the top level loop :(
   depth = L->getLoopDepth() - 1;     
   subLoops = !L->isInnermost();
-  BBs = numBasicBlocks;
-  instrs = numInstr;
-  atomics = numAtomics;
-  branches = numBranches;
+  BBs = T.BBs;
+  instrs = T.instrs;
+  atomics = T.atomics;
+  branches = T.branches;
 
   // We save the actual loop object here that contains all the basic block
   // and instruction info. Not required by part 1, but it makes writing part 2
@@ -88,15 +141,45 @@ void LoopPropertiesAnalysis::LoopProperties::print(raw_ostream &OS) {
 
 LoopPropertiesAnalysis::Result 
 LoopPropertiesAnalysis::run(Function &F, FunctionAnalysisManager &FAM) {
-  auto LV = std::vector<LoopProperties*>();
+  auto LV = Result();
   auto& LI = FAM.getResult<LoopAnalysis>(F);
+  auto& BS = FAM.getResult<BlockSummaryAnalysis>(F);
+
+  auto Loops = LI.getLoopsInPreorder();
+
+  // Every block only counts towards the innermost loop it's in at first, so
+  // the whole function is walked once no matter how deep the nests go. All
+  // loops get their entry up front so the references below stay valid.
+  DenseMap<const Loop*, LoopTotals> Totals;
+  for (auto *L : Loops) {
+    Totals[L];
+  }
+  for (auto &BB : F) {
+    auto *L = LI.getLoopFor(&BB);
+    if (!L) {
+      continue;
+    }
+    // per the assignment specifications, we don't want to count basic blocks 
+    // (or their branch instrs) from nested loops/children of this current loop
+    auto &T = Totals[L];
+    T.BBs++;
+    T.instrs += BS.instrs(&BB);
+    T.atomics += BS.atomics(&BB);
+    T.branches += BS.count(&BB, BlockSummaryAnalysis::Branch);
+  }
+
+  // Then the instructions and atomics get added up bottom-up: children come
+  // after their parent in preorder, so in reverse they're done before it
+  for (auto *L : llvm::reverse(Loops)) {
+    auto &T = Totals[L];
+    for (auto *Sub : L->getSubLoops()) {
+      T.instrs += Totals[Sub].instrs;
+      T.atomics += Totals[Sub].atomics;
+    }
+  }
 
-  // Start our pass by iterating through only the top level loops (depth = 0)
-  for (auto &L : LI.getLoopsInPreorder()) {
-    // errs() << "Current Loop:\n"; 
-    // L->print(errs());
-    // errs() << "\n"; 
-    LV.push_back(new LoopProperties(LI, L, LID, F.getName()));
+  for (auto &L : Loops) {
+    LV.push_back(std::make_unique<LoopProperties>(L, Totals[L], LID, F.getName()));
     LID++;
   }
 
@@ -127,6 +210,7 @@ PassPluginLibraryInfo getLoopAnalysisPluginInfo() {
             });
             PB.registerAnalysisRegistrationCallback(
                 [](FunctionAnalysisManager &FAM) {
+                  FAM.registerPass([&] { return BlockSummaryAnalysis(); });
                   FAM.registerPass([&] { return LoopPropertiesAnalysis(); });
             });
           }};
@@ -5,7 +5,9 @@
 
 #include <llvm/Analysis/LoopInfo.h>
 #include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
 #include <llvm/Pass.h>
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/IR/BasicBlock.h>
@@ -14,11 +16,85 @@
 #include <llvm/Support/Casting.h>
 #include <llvm/Support/Debug.h>
 #include <llvm/Support/raw_ostream.h>
+#include <array>
+#include <bitset>
+#include <memory>
 #include <vector>
 
+/*
+ * Per-block summary of what kinds of instructions a basic block contains,
+ * built once per function. Both the loop properties and LICM used to walk
+ * every instruction of every loop block (and nested blocks again at every
+ * depth), this lets them ask "any branches/atomics/hoistable instructions in
+ * here?" in constant time instead.
+ */
+class BlockSummaryAnalysis :
+  public llvm::AnalysisInfoMixin<BlockSummaryAnalysis> {
+public:
+  // Coarse instruction kinds, looked up straight from the opcode
+  enum OpcodeClass {
+    Branch,     // br (the only thing LoopProperties counts as a branch)
+    Hoistable,  // binary operator, shift, select, cast, getelementptr
+    Call,       // call, invoke, callbr
+    Memory,     // load, store, atomicrmw, cmpxchg, fence
+    Phi,
+    Other,
+    NumOpcodeClasses
+  };
+
+  static OpcodeClass classOf(const llvm::Instruction &I);
+
+  struct BlockSummary {
+    unsigned instrs = 0;
+    unsigned atomics = 0;
+    std::array<unsigned, NumOpcodeClasses> classes = {};
+
+    // Which opcode classes show up in the block at all, so "is there any X
+    // in here" is a single bit test
+    std::bitset<NumOpcodeClasses> kinds;
+  };
+
+  class Result {
+  public:
+    const BlockSummary &get(const llvm::BasicBlock *BB) const;
+
+    unsigned instrs(const llvm::BasicBlock *BB) const { return get(BB).instrs; }
+    unsigned atomics(const llvm::BasicBlock *BB) const { return get(BB).atomics; }
+    unsigned count(const llvm::BasicBlock *BB, OpcodeClass C) const {
+      return get(BB).classes[C];
+    }
+    bool has(const llvm::BasicBlock *BB, OpcodeClass C) const {
+      return get(BB).kinds[C];
+    }
+
+    // Keeps the summary in sync when a pass moves I from one block to another
+    void moveInstruction(const llvm::Instruction &I, const llvm::BasicBlock *From,
+                         const llvm::BasicBlock *To);
+
+  private:
+    friend class BlockSummaryAnalysis;
+    llvm::DenseMap<const llvm::BasicBlock*, BlockSummary> Blocks;
+  };
+
+  Result run(llvm::Function &F, llvm::FunctionAnalysisManager &);
+
+private:
+  static llvm::AnalysisKey Key;
+  friend struct llvm::AnalysisInfoMixin<BlockSummaryAnalysis>;
+};
+
 class LoopPropertiesAnalysis : 
   public llvm::AnalysisInfoMixin<LoopPropertiesAnalysis> {
 public:
+  // What a loop adds up to. BBs and branches only count the loop's own blocks,
+  // instrs and atomics include the subloops as well
+  struct LoopTotals {
+    int BBs = 0;
+    int instrs = 0;
+    int atomics = 0;
+    int branches = 0;
+  };
+
   struct LoopProperties {
     unsigned int id;
     std::string func; // name of the function containing this loop
@@ -31,13 +107,13 @@ public:
     
     const llvm::Loop *loop;
 
-    LoopProperties(const llvm::LoopInfo &LI, const llvm::Loop *L, 
-                   unsigned int LID, llvm::StringRef FName);
+    LoopProperties(const llvm::Loop *L, const LoopTotals &T, unsigned int LID,
+                   llvm::StringRef FName);
 
     void print(llvm::raw_ostream &OS);
   };
 
-  using Result = std::vector<LoopProperties*>;
+  using Result = std::vector<std::unique_ptr<LoopProperties>>;
   Result run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
 
 private:
@@ -62,4 +138,8 @@ public:
   static bool isRequired() { return true; }
 };
 
+// Plugin registration, exposed so tools can link the pass in directly instead
+// of going through -load-pass-plugin
+llvm::PassPluginLibraryInfo getLoopAnalysisPluginInfo();
+
 #endif
@@ -0,0 +1,446 @@
+/*
+ * Compile-time benchmark for the loop passes on generated loop nests.
+ *
+ * The test-cases directory only has a handful of tiny loops, which says
+ * nothing about how LoopPropertiesAnalysis and LICM scale. This tool
+ * generates modules with thousands of loops, nests up to 20 deep and long
+ * loop-invariant chains in the innermost bodies, times both passes on them
+ * and writes the results in Google Benchmark's JSON format: one "iteration"
+ * entry per repetition with its wall clock and process CPU time, followed by
+ * mean, median and stddev aggregates, so benchmark's compare.py works on it.
+ *
+ * Every generated function is one loop nest:
+ *
+ *   for (i0 = 0; i0 < n; i0++)
+ *     for (i1 = 0; i1 < n; i1++)
+ *       ...
+ *         for (iD = 0; iD < n; iD++) {
+ *           c0 = a + i<k>       // anchored on one of the induction variables
+ *           c1 = c0 * b
+ *           ...                 // "chain" instructions in total
+ *           out[iD] = c<last>
+ *         }
+ *
+ * so the whole chain is invariant in every loop below level k, and LICM has
+ * to carry it up through all of them.
+ *
+ * Usage:
+ *   loop-bench [-o results.json] [-reps=N] [-loops=N]
+ *   loop-bench -emit-ir=nest.ll -depth=20 -chain=64 -loops=2000
+ */
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <thread>
+
+#include "mp49774-an35288-loop-analysis-pass.h"
+#include "mp49774-an35288-loop-opt-pass.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> OutputFilename(
+    "o", cl::desc("Where to write the JSON results"),
+    cl::value_desc("file"), cl::init("loop-bench.json"));
+
+static cl::opt<unsigned> Reps("reps", cl::desc("Repetitions per benchmark"),
+                              cl::init(5));
+
+static cl::opt<unsigned> TotalLoops(
+    "loops", cl::desc("Roughly how many loops to generate per module"),
+    cl::init(2000));
+
+static cl::opt<std::string> EmitIR(
+    "emit-ir",
+    cl::desc("Only generate a module (see -depth/-chain/-loops) and write it "
+             "out as textual IR"),
+    cl::value_desc("file"));
+
+static cl::opt<unsigned> EmitDepth("depth", cl::desc("Nest depth for -emit-ir"),
+                                   cl::init(20));
+
+static cl::opt<unsigned> EmitChain("chain",
+                                   cl::desc("Invariant chain length for -emit-ir"),
+                                   cl::init(64));
+
+namespace {
+
+struct NestConfig {
+  unsigned depth;   // loops per nest, 1 = a single loop
+  unsigned chain;   // invariant instructions in the innermost body
+  unsigned nests;   // functions (one nest each) in the module
+};
+
+}
+
+// Builds void @nestN(i32 %n, i32 %a, i32 %b, ptr %out) as described at the
+// top of the file. Blocks are laid out preheader-before-header, which is what
+// LICM expects.
+static void buildNest(Module &M, unsigned Index, const NestConfig &Cfg) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I32 = Type::getInt32Ty(Ctx);
+  Type *OutTy = PointerType::getUnqual(I32);
+  auto *FT = FunctionType::get(Type::getVoidTy(Ctx), {I32, I32, I32, OutTy},
+                               false);
+  auto *F = Function::Create(FT, GlobalValue::ExternalLinkage,
+                             "nest" + Twine(Index), M);
+  Value *N = F->getArg(0);
+  Value *A = F->getArg(1);
+  Value *B = F->getArg(2);
+  Value *Out = F->getArg(3);
+
+  unsigned D = Cfg.depth;
+  SmallVector<BasicBlock*, 20> Pre, Header, Body, Latch;
+  for (unsigned k = 0; k < D; k++) {
+    Pre.push_back(BasicBlock::Create(Ctx, "pre" + Twine(k), F));
+    Header.push_back(BasicBlock::Create(Ctx, "header" + Twine(k), F));
+    Body.push_back(BasicBlock::Create(Ctx, "body" + Twine(k), F));
+  }
+  Latch.resize(D);
+  for (int k = D - 1; k >= 0; k--) {
+    Latch[k] = BasicBlock::Create(Ctx, "latch" + Twine(k), F);
+  }
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", F);
+
+  IRBuilder<> IRB(Ctx);
+  SmallVector<PHINode*, 20> IV;
+  for (unsigned k = 0; k < D; k++) {
+    IRB.SetInsertPoint(Pre[k]);
+    IRB.CreateBr(Header[k]);
+
+    // Inner loops exit into their parent's latch
+    IRB.SetInsertPoint(Header[k]);
+    PHINode *Phi = IRB.CreatePHI(I32, 2, "i" + Twine(k));
+    Phi->addIncoming(IRB.getInt32(0), Pre[k]);
+    IV.push_back(Phi);
+    Value *Cond = IRB.CreateICmpSLT(Phi, N);
+    IRB.CreateCondBr(Cond, Body[k], k == 0 ? Exit : Latch[k - 1]);
+
+    IRB.SetInsertPoint(Body[k]);
+    if (k + 1 < D) {
+      IRB.CreateBr(Pre[k + 1]);
+    }
+  }
+
+  // The chain hangs off one of the induction variables, which one varies
+  // from nest to nest so we get chains that go all the way out as well as
+  // ones that stop partway
+  unsigned Anchor = Index % (D + 1);
+  Value *V = Anchor == D ? B : static_cast<Value*>(IV[Anchor]);
+  V = IRB.CreateAdd(A, V, "c0");
+  for (unsigned c = 1; c < Cfg.chain; c++) {
+    switch (c % 3) {
+    case 0: V = IRB.CreateAdd(V, A, "c" + Twine(c)); break;
+    case 1: V = IRB.CreateMul(V, B, "c" + Twine(c)); break;
+    case 2: V = IRB.CreateShl(V, IRB.getInt32(1), "c" + Twine(c)); break;
+    }
+  }
+  Value *Slot = IRB.CreateGEP(I32, Out, IV[D - 1]);
+  IRB.CreateStore(V, Slot);
+  IRB.CreateBr(Latch[D - 1]);
+
+  for (unsigned k = 0; k < D; k++) {
+    IRB.SetInsertPoint(Latch[k]);
+    Value *Next = IRB.CreateAdd(IV[k], IRB.getInt32(1), "i" + Twine(k) + ".next");
+    IV[k]->addIncoming(Next, Latch[k]);
+    IRB.CreateBr(Header[k]);
+  }
+
+  IRB.SetInsertPoint(Exit);
+  IRB.CreateRetVoid();
+
+  // Entry block has to come first and can't have predecessors
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F, Pre[0]);
+  IRB.SetInsertPoint(Entry);
+  IRB.CreateBr(Pre[0]);
+}
+
+static std::unique_ptr<Module> buildModule(LLVMContext &Ctx,
+                                           const NestConfig &Cfg) {
+  auto M = std::make_unique<Module>("loop-bench", Ctx);
+  for (unsigned i = 0; i < Cfg.nests; i++) {
+    buildNest(*M, i, Cfg);
+  }
+  if (verifyModule(*M, &errs())) {
+    report_fatal_error("generated module is broken");
+  }
+  return M;
+}
+
+namespace {
+
+// Same analysis setup opt has, with our plugins linked in
+struct PassSetup {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+
+  PassSetup() {
+    getLoopAnalysisPluginInfo().RegisterPassBuilderCallbacks(PB);
+    getLoopOptPassPluginInfo().RegisterPassBuilderCallbacks(PB);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  }
+};
+
+// Wall clock and CPU time of one repetition, in ms
+struct Sample {
+  double real;
+  double cpu;
+};
+
+struct Timing {
+  std::string name;
+  NestConfig cfg;
+  std::vector<Sample> samples;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Measures both clocks from construction to sample()
+class Stopwatch {
+  Clock::time_point RealStart = Clock::now();
+  std::clock_t CPUStart = std::clock();
+
+public:
+  Sample sample() const {
+    auto Real = std::chrono::duration<double, std::milli>(Clock::now() - RealStart);
+    return {Real.count(), 1000.0 * (std::clock() - CPUStart) / CLOCKS_PER_SEC};
+  }
+};
+
+}
+
+// Only the analysis itself is timed. LoopInfo and the dominator tree are
+// computed up front and kept, the loop properties (and the block summary they
+// are built from) are thrown away before every repetition.
+static Timing benchAnalysis(const NestConfig &Cfg) {
+  Timing T{"LoopPropertiesAnalysis", Cfg, {}};
+  LLVMContext Ctx;
+  auto M = buildModule(Ctx, Cfg);
+  PassSetup S;
+
+  for (auto &F : *M) {
+    S.FAM.getResult<LoopAnalysis>(F);
+  }
+
+  PreservedAnalyses PA = PreservedAnalyses::all();
+  PA.abandon<LoopPropertiesAnalysis>();
+  PA.abandon<BlockSummaryAnalysis>();
+
+  for (unsigned r = 0; r < Reps; r++) {
+    for (auto &F : *M) {
+      S.FAM.invalidate(F, PA);
+    }
+
+    Stopwatch W;
+    for (auto &F : *M) {
+      S.FAM.getResult<LoopPropertiesAnalysis>(F);
+    }
+    T.samples.push_back(W.sample());
+  }
+
+  S.FAM.clear();
+  return T;
+}
+
+// LICM changes the IR, so every repetition gets a freshly generated module.
+// Timed is the same pipeline opt runs for -passes=mp49774-an35288-loop-opt-pass.
+static Timing benchLICM(const NestConfig &Cfg) {
+  Timing T{"LoopInvariantCodeMotion", Cfg, {}};
+
+  for (unsigned r = 0; r < Reps; r++) {
+    LLVMContext Ctx;
+    auto M = buildModule(Ctx, Cfg);
+    PassSetup S;
+
+    FunctionPassManager FPM;
+    if (auto Err = S.PB.parsePassPipeline(FPM, "mp49774-an35288-loop-opt-pass")) {
+      report_fatal_error(std::move(Err));
+    }
+
+    Stopwatch W;
+    for (auto &F : *M) {
+      FPM.run(F, S.FAM);
+    }
+    T.samples.push_back(W.sample());
+
+    S.FAM.clear();
+  }
+  return T;
+}
+
+static double mean(ArrayRef<double> Xs) {
+  double Sum = 0;
+  for (auto X : Xs) {
+    Sum += X;
+  }
+  return Sum / Xs.size();
+}
+
+static double median(ArrayRef<double> Samples) {
+  std::vector<double> Xs = Samples.vec();
+  std::sort(Xs.begin(), Xs.end());
+  size_t N = Xs.size();
+  return N % 2 ? Xs[N / 2] : (Xs[N / 2 - 1] + Xs[N / 2]) / 2;
+}
+
+// Sample standard deviation, which is what benchmark reports too
+static double stddev(ArrayRef<double> Xs) {
+  if (Xs.size() < 2) {
+    return 0;
+  }
+  double M = mean(Xs);
+  double Sum = 0;
+  for (auto X : Xs) {
+    Sum += (X - M) * (X - M);
+  }
+  return std::sqrt(Sum / (Xs.size() - 1));
+}
+
+static std::string benchName(const Timing &T) {
+  return T.name + "/depth:" + std::to_string(T.cfg.depth) +
+         "/chain:" + std::to_string(T.cfg.chain) +
+         "/loops:" + std::to_string(T.cfg.depth * T.cfg.nests);
+}
+
+// Adds one entry per repetition and the aggregates over them, the same way
+// benchmark does with --benchmark_repetitions
+static void appendJSON(const Timing &T, json::Array &Out) {
+  std::string Name = benchName(T);
+  int64_t NumReps = T.samples.size();
+
+  auto entry = [&](std::string EntryName, double Real, double CPU) {
+    return json::Object{
+        {"name", std::move(EntryName)},
+        {"run_name", Name},
+        {"repetitions", NumReps},
+        {"threads", 1},
+        {"real_time", Real},
+        {"cpu_time", CPU},
+        {"time_unit", "ms"},
+        {"depth", (int64_t)T.cfg.depth},
+        {"chain", (int64_t)T.cfg.chain},
+        {"loops", (int64_t)(T.cfg.depth * T.cfg.nests)},
+    };
+  };
+
+  std::vector<double> Real, CPU;
+  for (int64_t i = 0; i < NumReps; i++) {
+    auto &S = T.samples[i];
+    Real.push_back(S.real);
+    CPU.push_back(S.cpu);
+
+    auto Obj = entry(Name, S.real, S.cpu);
+    Obj["run_type"] = "iteration";
+    Obj["repetition_index"] = i;
+    Obj["iterations"] = 1;
+    Out.push_back(std::move(Obj));
+  }
+
+  std::pair<StringRef, double (*)(ArrayRef<double>)> Aggregates[] = {
+      {"mean", mean},
+      {"median", median},
+      {"stddev", stddev},
+  };
+  for (auto &Agg : Aggregates) {
+    auto Obj = entry(Name + "_" + Agg.first.str(), Agg.second(Real),
+                     Agg.second(CPU));
+    Obj["run_type"] = "aggregate";
+    Obj["aggregate_name"] = Agg.first;
+    Obj["aggregate_unit"] = "time";
+    Obj["iterations"] = NumReps;
+    Out.push_back(std::move(Obj));
+  }
+}
+
+static NestConfig configFor(unsigned Depth, unsigned Chain) {
+  return {Depth, Chain, std::max(1u, (unsigned)TotalLoops / Depth)};
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "loop pass compile-time benchmark\n");
+
+  if (!EmitIR.empty()) {
+    LLVMContext Ctx;
+    auto M = buildModule(Ctx, configFor(std::max(1u, (unsigned)EmitDepth),
+                                        std::max(1u, (unsigned)EmitChain)));
+    std::error_code EC;
+    raw_fd_ostream OS(EmitIR, EC, sys::fs::OF_Text);
+    if (EC) {
+      errs() << "can't open " << EmitIR << ": " << EC.message() << "\n";
+      return 1;
+    }
+    M->print(OS, nullptr);
+    return 0;
+  }
+  if (Reps == 0) {
+    errs() << "-reps has to be at least 1\n";
+    return 1;
+  }
+
+  json::Array Results;
+  for (unsigned Depth : {1u, 2u, 5u, 10u, 20u}) {
+    for (unsigned Chain : {8u, 64u}) {
+      auto Cfg = configFor(Depth, Chain);
+      for (auto &T : {benchAnalysis(Cfg), benchLICM(Cfg)}) {
+        std::vector<double> Real;
+        for (auto &S : T.samples) {
+          Real.push_back(S.real);
+        }
+        errs() << benchName(T) << ": " << format("%.3f", median(Real))
+               << " ms\n";
+        appendJSON(T, Results);
+      }
+    }
+  }
+
+  char Date[32];
+  std::time_t Now = std::time(nullptr);
+  std::strftime(Date, sizeof(Date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&Now));
+
+  json::Object Context{
+      {"date", Date},
+      {"executable", argv[0]},
+      {"num_cpus", (int64_t)std::thread::hardware_concurrency()},
+#ifdef NDEBUG
+      {"library_build_type", "release"},
+#else
+      {"library_build_type", "debug"},
+#endif
+      {"repetitions", (int64_t)Reps},
+      {"llvm_version", LLVM_VERSION_STRING},
+  };
+  json::Value Root = json::Object{
+      {"context", std::move(Context)},
+      {"benchmarks", std::move(Results)},
+  };
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutputFilename, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "can't open " << OutputFilename << ": " << EC.message() << "\n";
+    return 1;
+  }
+  OS << formatv("{0:2}", Root) << "\n";
+  return 0;
+}
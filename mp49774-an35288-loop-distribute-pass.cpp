@@ -0,0 +1,492 @@
+#include "mp49774-an35288-loop-distribute-pass.h"
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/LoopIterator.h>
+#include <llvm/Analysis/MemoryLocation.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/Support/Casting.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include <functional>
+
+using namespace llvm;
+
+namespace {
+
+// How two memory instructions of the same loop iteration constrain each other.
+// Forward means Src has to run before Dst (so Src's loop can simply go first),
+// Cyclic means they have to stay in the same loop.
+enum class DepKind { None, Forward, Cyclic };
+
+}
+
+// Atomics with anything stronger than relaxed ordering (and fences) order the
+// surrounding memory operations too, so nothing may be moved across them
+static bool isOrderedAtomic(const Instruction *I) {
+  if (isa<FenceInst>(I)) {
+    return true;
+  }
+  if (auto *RMW = dyn_cast<AtomicRMWInst>(I)) {
+    return isStrongerThanMonotonic(RMW->getOrdering());
+  }
+  if (auto *CX = dyn_cast<AtomicCmpXchgInst>(I)) {
+    return isStrongerThanMonotonic(CX->getSuccessOrdering()) ||
+           isStrongerThanMonotonic(CX->getFailureOrdering());
+  }
+  if (auto *LD = dyn_cast<LoadInst>(I)) {
+    return isStrongerThanMonotonic(LD->getOrdering());
+  }
+  if (auto *ST = dyn_cast<StoreInst>(I)) {
+    return isStrongerThanMonotonic(ST->getOrdering());
+  }
+  return false;
+}
+
+static bool isSimpleLoadStore(const Instruction *I) {
+  if (auto *LD = dyn_cast<LoadInst>(I)) {
+    return LD->isSimple();
+  }
+  if (auto *ST = dyn_cast<StoreInst>(I)) {
+    return ST->isSimple();
+  }
+  return false;
+}
+
+// This is the stuff we want to pull out into its own (scalar) loop
+static bool isIrregular(const Instruction *I) {
+  return I->isAtomic() || (isa<CallBase>(I) && !isa<DbgInfoIntrinsic>(I));
+}
+
+static DepKind classifyDependence(Instruction *Src, Instruction *Dst,
+                                  const Loop *L, AAResults &AA,
+                                  DependenceInfo &DI) {
+  if (isOrderedAtomic(Src) || isOrderedAtomic(Dst)) {
+    return DepKind::Cyclic;
+  }
+  if (Src->isVolatile() && Dst->isVolatile()) {
+    return DepKind::Cyclic;
+  }
+
+  // Plain loads and stores get the full dependence test, which can tell us
+  // which way a loop-carried dependence points. Anything where the later
+  // instruction (Dst) reaches back into an earlier iteration of Src can't be
+  // split, since Src's loop would already have finished by then.
+  if (isSimpleLoadStore(Src) && isSimpleLoadStore(Dst)) {
+    auto D = DI.depends(Src, Dst, true);
+    if (!D) {
+      return DepKind::None;
+    }
+
+    unsigned Level = L->getLoopDepth();
+    if (D->isConfused() || D->getLevels() < Level ||
+        (D->getDirection(Level) & Dependence::DVEntry::GT)) {
+      return DepKind::Cyclic;
+    }
+    return DepKind::Forward;
+  }
+
+  // Atomics and calls only have alias information to go on, so any overlap
+  // at all keeps them in the same loop
+  auto *SrcCall = dyn_cast<CallBase>(Src);
+  auto *DstCall = dyn_cast<CallBase>(Dst);
+  if (SrcCall && DstCall) {
+    return isNoModRef(AA.getModRefInfo(SrcCall, DstCall)) ? DepKind::None
+                                                           : DepKind::Cyclic;
+  }
+  if (SrcCall || DstCall) {
+    auto *Call = SrcCall ? SrcCall : DstCall;
+    auto Loc = MemoryLocation::getOrNone(SrcCall ? Dst : Src);
+    return Loc && isNoModRef(AA.getModRefInfo(Call, *Loc)) ? DepKind::None
+                                                          : DepKind::Cyclic;
+  }
+
+  auto SrcLoc = MemoryLocation::getOrNone(Src);
+  auto DstLoc = MemoryLocation::getOrNone(Dst);
+  if (SrcLoc && DstLoc && AA.isNoAlias(*SrcLoc, *DstLoc)) {
+    return DepKind::None;
+  }
+  return DepKind::Cyclic;
+}
+
+// Plain old Tarjan. Fills in the component index of every node and returns
+// how many components there are.
+static unsigned findSCCs(const SmallVectorImpl<SmallVector<unsigned, 4>> &Succs,
+                         SmallVectorImpl<unsigned> &Comp) {
+  unsigned N = Succs.size();
+  unsigned NextIndex = 0;
+  unsigned NumComps = 0;
+  SmallVector<unsigned> Index(N, ~0u);
+  SmallVector<unsigned> LowLink(N, 0);
+  SmallVector<bool> OnStack(N, false);
+  SmallVector<unsigned> Stack;
+  Comp.assign(N, ~0u);
+
+  std::function<void(unsigned)> visit = [&](unsigned V) {
+    Index[V] = LowLink[V] = NextIndex++;
+    Stack.push_back(V);
+    OnStack[V] = true;
+
+    for (auto W : Succs[V]) {
+      if (Index[W] == ~0u) {
+        visit(W);
+        LowLink[V] = std::min(LowLink[V], LowLink[W]);
+      }
+      else if (OnStack[W]) {
+        LowLink[V] = std::min(LowLink[V], Index[W]);
+      }
+    }
+
+    if (LowLink[V] == Index[V]) {
+      unsigned W;
+      do {
+        W = Stack.pop_back_val();
+        OnStack[W] = false;
+        Comp[W] = NumComps;
+      } while (W != V);
+      NumComps++;
+    }
+  };
+
+  for (unsigned V = 0; V < N; V++) {
+    if (Index[V] == ~0u) {
+      visit(V);
+    }
+  }
+  return NumComps;
+}
+
+// Everything is already unreachable from the outside by the time we get here,
+// so drop the references first and only then delete, otherwise we'd trip over
+// uses between two instructions that are both going away
+static void removeInstructions(SmallVectorImpl<Instruction*> &Dead) {
+  for (auto *I : Dead) {
+    I->dropAllReferences();
+  }
+  for (auto *I : Dead) {
+    I->eraseFromParent();
+  }
+}
+
+bool LoopDistribution::isCandidate(const LoopPropertiesAnalysis::LoopProperties &P,
+                                   const BlockSummaryAnalysis::Result &BS) {
+  if (P.subLoops || P.instrs > (int)MaxInstrs) {
+    return false;
+  }
+  if (P.atomics > 0) {
+    return true;
+  }
+
+  // LoopProperties doesn't count calls, but the block summary does. (Debug
+  // intrinsics count as calls there too, partition() sorts those out.)
+  for (auto *BB : P.loop->blocks()) {
+    if (BS.has(BB, BlockSummaryAnalysis::Call)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Decides which loop every instruction goes to. Returns false if the loop
+ * can't (or shouldn't) be distributed.
+ *
+ * The "backbone" of the loop is everything the control flow depends on: the
+ * terminators and whatever they're computed from. Every copy of the loop needs
+ * its own backbone, so it has to be pure register computation -- if the trip
+ * count came from memory, the first loop could change it for the second one.
+ *
+ * The rest of the instructions become nodes in a dependence graph:
+ *
+ *   - def-use edges go both ways, since we don't want to pass values between
+ *     the new loops through memory
+ *   - memory dependences the loop can't "see past" go both ways
+ *   - forward-only memory dependences go from the earlier to the later
+ *     instruction
+ *
+ * The SCCs of that graph are the smallest pieces we can move around. We then
+ * put them in a topological order that keeps clean and irregular components
+ * together as much as possible, and start a new loop whenever the kind
+ * changes.
+ */
+bool LoopDistribution::partition(Loop *L, LoopInfo &LI, AAResults &AA,
+                                 DependenceInfo &DI, PartitionMap &Parts,
+                                 unsigned &NumParts) {
+  if (!L->getLoopPreheader() || !L->getLoopLatch() || !L->getExitBlock()) {
+    return false;
+  }
+
+  SmallPtrSet<Instruction*, 32> Backbone;
+  SmallVector<Instruction*> Worklist;
+  for (auto *BB : L->blocks()) {
+    Worklist.push_back(BB->getTerminator());
+  }
+  while (!Worklist.empty()) {
+    auto *I = Worklist.pop_back_val();
+    if (!Backbone.insert(I).second) {
+      continue;
+    }
+    if (I->mayReadOrWriteMemory()) {
+      return false;
+    }
+    for (auto &OP : I->operands()) {
+      auto Def = dyn_cast<Instruction>(OP.get());
+      if (Def && L->contains(Def)) {
+        Worklist.push_back(Def);
+      }
+    }
+  }
+
+  // Number the remaining instructions in program order, so memory dependence
+  // queries always go from the instruction that runs first
+  LoopBlocksRPO RPOT(L);
+  RPOT.perform(&LI);
+
+  SmallVector<Instruction*> Insts;
+  DenseMap<Instruction*, unsigned> Idx;
+  for (auto *BB : RPOT) {
+    for (auto &I : *BB) {
+      if (Backbone.count(&I)) {
+        continue;
+      }
+      // If something can bail out of the loop halfway, the loops in front of
+      // it would already have run iterations they never should have
+      if (!isGuaranteedToTransferExecutionToSuccessor(&I)) {
+        return false;
+      }
+      Idx[&I] = Insts.size();
+      Insts.push_back(&I);
+    }
+  }
+
+  unsigned N = Insts.size();
+  SmallVector<SmallVector<unsigned, 4>> Succs(N);
+  SmallVector<unsigned> LiveOut;
+
+  for (unsigned i = 0; i < N; i++) {
+    for (auto *U : Insts[i]->users()) {
+      auto UI = cast<Instruction>(U);
+      if (!L->contains(UI)) {
+        LiveOut.push_back(i);
+        continue;
+      }
+      // The backbone never uses anything outside the backbone, so the user
+      // is always one of ours
+      unsigned j = Idx.lookup(UI);
+      Succs[i].push_back(j);
+      Succs[j].push_back(i);
+    }
+  }
+
+  SmallVector<unsigned> MemInsts;
+  for (unsigned i = 0; i < N; i++) {
+    if (Insts[i]->mayReadOrWriteMemory()) {
+      MemInsts.push_back(i);
+    }
+  }
+
+  unsigned Queries = 0;
+  for (unsigned a = 0; a < MemInsts.size(); a++) {
+    for (unsigned b = a + 1; b < MemInsts.size(); b++) {
+      unsigned i = MemInsts[a];
+      unsigned j = MemInsts[b];
+      if (!Insts[i]->mayWriteToMemory() && !Insts[j]->mayWriteToMemory()) {
+        continue;
+      }
+      if (++Queries > MaxDeps) {
+        return false;
+      }
+
+      switch (classifyDependence(Insts[i], Insts[j], L, AA, DI)) {
+      case DepKind::None:
+        break;
+      case DepKind::Forward:
+        Succs[i].push_back(j);
+        break;
+      case DepKind::Cyclic:
+        Succs[i].push_back(j);
+        Succs[j].push_back(i);
+        break;
+      }
+    }
+  }
+
+  SmallVector<unsigned> Comp;
+  unsigned NumComps = findSCCs(Succs, Comp);
+
+  SmallVector<bool> CompIrregular(NumComps, false);
+  for (unsigned i = 0; i < N; i++) {
+    if (isIrregular(Insts[i])) {
+      CompIrregular[Comp[i]] = true;
+    }
+  }
+
+  // Collapse the instruction graph down to a DAG of components
+  SmallVector<SmallVector<unsigned, 4>> CompSuccs(NumComps);
+  SmallVector<unsigned> InDegree(NumComps, 0);
+  DenseSet<std::pair<unsigned, unsigned>> SeenEdges;
+  for (unsigned i = 0; i < N; i++) {
+    for (auto j : Succs[i]) {
+      unsigned From = Comp[i];
+      unsigned To = Comp[j];
+      if (From != To && SeenEdges.insert({From, To}).second) {
+        CompSuccs[From].push_back(To);
+        InDegree[To]++;
+      }
+    }
+  }
+
+  // Values used after the loop have to come out of the original loop, which
+  // is the one that ends up last. So if clean work produces one (a reduction,
+  // say), the irregular work should go first.
+  bool CleanLiveOut = false;
+  for (auto i : LiveOut) {
+    CleanLiveOut |= !CompIrregular[Comp[i]];
+  }
+
+  // Topological sort that sticks with the current kind of component for as
+  // long as it can, starting with kind Start (0 for clean, 1 for irregular)
+  // if there's anything of that kind ready. Returns the number of partitions.
+  SmallVector<unsigned> CompPart(NumComps, 0);
+  auto schedule = [&](unsigned Start) {
+    SmallVector<unsigned> Degree = InDegree;
+    SmallVector<unsigned> Ready[2];
+    for (unsigned C = 0; C < NumComps; C++) {
+      if (Degree[C] == 0) {
+        Ready[CompIrregular[C]].push_back(C);
+      }
+    }
+
+    unsigned Cur = Ready[Start].empty() ? !Start : Start;
+    unsigned Part = 0;
+    while (!Ready[0].empty() || !Ready[1].empty()) {
+      if (Ready[Cur].empty()) {
+        Cur = !Cur;
+        Part++;
+      }
+
+      unsigned C = Ready[Cur].pop_back_val();
+      CompPart[C] = Part;
+      for (auto S : CompSuccs[C]) {
+        if (--Degree[S] == 0) {
+          Ready[CompIrregular[S]].push_back(S);
+        }
+      }
+    }
+    return Part + 1;
+  };
+
+  auto liveOutsLast = [&] {
+    for (auto i : LiveOut) {
+      if (CompPart[Comp[i]] != NumParts - 1) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Try the order that should work first, and the other one if it doesn't
+  unsigned First = CleanLiveOut ? 1 : 0;
+  NumParts = schedule(First);
+  if (NumParts >= 2 && !liveOutsLast()) {
+    NumParts = schedule(!First);
+  }
+  if (NumParts < 2 || !liveOutsLast()) {
+    return false;
+  }
+
+  for (unsigned i = 0; i < N; i++) {
+    Parts[Insts[i]] = CompPart[Comp[i]];
+  }
+  return true;
+}
+
+/*
+ * The original loop keeps the last partition. Every other partition gets its
+ * own copy of the loop (with a fresh preheader), and the copies are chained
+ * in front of the original, i.e. for three partitions:
+ *
+ *   Pred -> PH.ldist0 -> loop.ldist0 -> PH.ldist1 -> loop.ldist1 -> PH -> loop
+ *
+ * Each copy then deletes everything that isn't backbone or its own partition.
+ */
+void LoopDistribution::distribute(Loop *L, LoopInfo &LI, DominatorTree &DT,
+                                  const PartitionMap &Parts,
+                                  unsigned NumParts) {
+  // Give the loop an empty preheader of its own so cloning it doesn't drag
+  // along whatever was in front of the loop
+  BasicBlock *Pred = L->getLoopPreheader();
+  BasicBlock *OrigPH = SplitBlock(Pred, Pred->getTerminator(), &DT, &LI);
+  BasicBlock *ExitBlock = L->getExitBlock();
+
+  BasicBlock *TopPH = OrigPH;
+  for (int Part = NumParts - 2; Part >= 0; Part--) {
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock*, 8> Blocks;
+    Loop *NewLoop = cloneLoopWithPreheader(TopPH, Pred, L, VMap,
+                                           ".ldist" + Twine(Part), &LI, &DT,
+                                           Blocks);
+
+    // The copy falls through into the next loop instead of leaving
+    VMap[ExitBlock] = TopPH;
+    remapInstructionsInBlocks(Blocks, VMap);
+
+    SmallVector<Instruction*> Dead;
+    for (auto &Entry : Parts) {
+      if (Entry.second != (unsigned)Part) {
+        Value *V = VMap[Entry.first];
+        Dead.push_back(cast<Instruction>(V));
+      }
+    }
+    removeInstructions(Dead);
+
+    TopPH = NewLoop->getLoopPreheader();
+  }
+  Pred->getTerminator()->replaceUsesOfWith(OrigPH, TopPH);
+
+  SmallVector<Instruction*> Dead;
+  for (auto &Entry : Parts) {
+    if (Entry.second != NumParts - 1) {
+      Dead.push_back(Entry.first);
+    }
+  }
+  removeInstructions(Dead);
+
+  // We rewired the preheaders by hand, easier to just start over
+  DT.recalculate(*Pred->getParent());
+}
+
+PreservedAnalyses
+LoopDistribution::run(Function &F, FunctionAnalysisManager &FAM) {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &LP = FAM.getResult<LoopPropertiesAnalysis>(F);
+  auto &BS = FAM.getResult<BlockSummaryAnalysis>(F);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &AA = FAM.getResult<AAManager>(F);
+  auto &DI = FAM.getResult<DependenceAnalysis>(F);
+
+  // Pick the loops up front, distributing adds new loops to LI as we go
+  SmallVector<Loop*> Candidates;
+  for (auto &P : LP) {
+    if (isCandidate(*P, BS)) {
+      Candidates.push_back(const_cast<Loop*>(P->loop));
+    }
+  }
+
+  bool changed = false;
+  for (auto *L : Candidates) {
+    PartitionMap Parts;
+    unsigned NumParts = 0;
+    if (!partition(L, LI, AA, DI, Parts, NumParts)) {
+      continue;
+    }
+    distribute(L, LI, DT, Parts, NumParts);
+    changed = true;
+  }
+
+  return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
@@ -0,0 +1,59 @@
+#ifndef MP49774_AN35288_LOOP_DISTRIBUTE_PASS_H
+#define MP49774_AN35288_LOOP_DISTRIBUTE_PASS_H
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Analysis/DependenceAnalysis.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "mp49774-an35288-loop-analysis-pass.h"
+
+/*
+ * Loop distribution (a.k.a. loop fission).
+ *
+ * Splits an innermost loop that mixes "clean" work (plain loads, stores and
+ * arithmetic) with "irregular" work (atomics, calls) into several loops that
+ * each run the full iteration space. Instructions are grouped by the strongly
+ * connected components of their dependence graph, so anything that feeds
+ * itself across iterations stays together, and components of the same kind
+ * are merged into one loop. The clean loop can then be picked up by the
+ * vectorizer while the irregular one stays scalar.
+ */
+class LoopDistribution : public llvm::PassInfoMixin<LoopDistribution> {
+
+public:
+  // Loops with more instructions than this are left alone
+  static constexpr unsigned DefaultMaxInstrs = 256;
+  // Give up on a loop once we've asked this many memory dependence queries
+  static constexpr unsigned DefaultMaxDeps = 1024;
+
+  LoopDistribution(unsigned MaxInstrs = DefaultMaxInstrs,
+                   unsigned MaxDeps = DefaultMaxDeps)
+      : MaxInstrs(MaxInstrs), MaxDeps(MaxDeps) {}
+
+  llvm::PreservedAnalyses run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
+
+  static bool isRequired() { return true; }
+
+private:
+  unsigned MaxInstrs;
+  unsigned MaxDeps;
+
+  // Maps every non-backbone instruction of a loop to the index of the loop
+  // it ends up in after distribution
+  using PartitionMap = llvm::DenseMap<llvm::Instruction*, unsigned>;
+
+  bool isCandidate(const LoopPropertiesAnalysis::LoopProperties &P,
+                   const BlockSummaryAnalysis::Result &BS);
+  bool partition(llvm::Loop *L, llvm::LoopInfo &LI, llvm::AAResults &AA,
+                 llvm::DependenceInfo &DI, PartitionMap &Parts, unsigned &NumParts);
+  void distribute(llvm::Loop *L, llvm::LoopInfo &LI, llvm::DominatorTree &DT,
+                  const PartitionMap &Parts, unsigned NumParts);
+};
+
+#endif
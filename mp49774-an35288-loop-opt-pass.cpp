@@ -1,6 +1,8 @@
 #include "mp49774-an35288-loop-opt-pass.h"
 #include "mp49774-an35288-loop-analysis-pass.h"
+#include "mp49774-an35288-loop-distribute-pass.h"
 #include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/PostOrderIterator.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/Analysis/LoopInfo.h>
 #include <llvm/IR/Constant.h>
@@ -37,15 +39,13 @@ using namespace llvm;
  *
  */
 bool LoopInvariantCodeMotion::isLoopInvariant(llvm::Instruction *I, 
-                                              const llvm::LoopInfo &LI) {
+                                              const llvm::Loop *curr_loop) {
   // binary operator, shift, select, cast, getelementptr
-  // todo - why is shift not included??
-  if (!(isa<BinaryOperator>(I) || isa<SelectInst>(I) || isa<CastInst>(I) || 
-      isa<GetElementPtrInst>(I) || I->isShift()))
+  // (shifts are binary operators, so they're covered by the same class)
+  if (BlockSummaryAnalysis::classOf(*I) != BlockSummaryAnalysis::Hoistable)
     return false;
     // errs() << "Howdy :)\n";
 
-  auto curr_loop = LI.getLoopFor(I->getParent());
   SmallVector<bool> results;
 
   for (auto &OP : I->operands()) {
@@ -120,26 +120,20 @@ bool LoopInvariantCodeMotion::isLoopInvariant(llvm::Instruction *I,
  *
  * 2. The basic block containing the instruction dominates all exit blocks for the loop. The exit blocks are targets
  *      of exits from the loop, i.e. they are outside the loop.
+ *
+ * BB is the block the instruction would be hoisted out of. That's not always
+ * I's parent: when we hoist across several loops at once, for every loop past
+ * the first one it's the preheader the instruction would have landed in.
  */
 bool LoopInvariantCodeMotion::safeToHoist(llvm::Instruction *I,
-                                          const llvm::LoopInfo &LI,
+                                          const llvm::BasicBlock *BB,
+                                          const llvm::Loop *L,
                                           const llvm::DominatorTree &DT) {
 
     if(isSafeToSpeculativelyExecute(I)){
        return true;
     }
 
-    // get the BB of the instruction
-    BasicBlock *BB = I->getParent();
-
-    // get the loop of the BB of the instruction
-    const Loop *L = LI.getLoopFor(BB);
-
-    // todo - what to do in the case for loopless instructions?
-    if(!L){
-        return false; // don't touch for now
-    }
-
     // obtain exit blocks for the loop
     /*std::vector<BasicBlock*> ExitBlocks;
     for (auto *Succ : successors(BB)) {
@@ -163,15 +157,44 @@ bool LoopInvariantCodeMotion::safeToHoist(llvm::Instruction *I,
 
 }
 
-// Really simple function to see how deeply nested the loops in our function are
-int LoopInvariantCodeMotion::maxLoopDepth(LoopPropertiesAnalysis::Result LP) {
-  int res = 0;
-  for (auto &P : LP) {
-    if (P->depth > res) {
-      res = P->depth;
+/*
+ * Finds the outermost loop I can be hoisted out of, or nullptr if it has to
+ * stay where it is.
+ *
+ * We used to hoist one level at a time: the deepest loops first, moving each
+ * invariant into its parent, then redoing the whole depth and working our way
+ * up, so an invariant three loops deep got moved three times. Instead we now
+ * walk up the loop tree from I's loop and keep going for as long as I is
+ * still invariant and safe to hoist at that level. Legality is still checked
+ * for every loop on the way, exactly like the step-by-step version would:
+ *
+ *   while (a) {         <- stop here if x isn't safe to hoist out of this one
+ *     while (b) {       <- x is checked against this loop from its preheader
+ *       while (c) {     <- x is checked against this loop from its own block
+ *         x = p + q;
+ *       }
+ *     }
+ *   }
+ */
+const Loop *LoopInvariantCodeMotion::hoistTarget(Instruction *I,
+                                                 const LoopInfo &LI,
+                                                 const DominatorTree &DT) {
+  const Loop *target = nullptr;
+  const BasicBlock *from = I->getParent();
+
+  for (const Loop *L = LI.getLoopFor(from); L; L = L->getParentLoop()) {
+    // No dedicated preheader means no place to put it (LoopSimplify normally
+    // makes sure there is one)
+    BasicBlock *preheader = L->getLoopPreheader();
+    if (!preheader || !isLoopInvariant(I, L) || !safeToHoist(I, from, L, DT)) {
+      break;
     }
+
+    target = L;
+    from = preheader;
   }
-  return res;
+
+  return target;
 }
 
 // If there's something that seems wierd code-style wise, it's LLVM's fault for
@@ -179,175 +202,88 @@ int LoopInvariantCodeMotion::maxLoopDepth(LoopPropertiesAnalysis::Result LP) {
 PreservedAnalyses 
 LoopInvariantCodeMotion::run(Function &F, 
                              FunctionAnalysisManager &FAM) {
-  //errs() << "hey ;)\n";
-
   // get the basic Loop Information analysis passes
   // (LI for Loop Info)
   auto &LI = FAM.getResult<LoopAnalysis>(F);
 
-  // Code for getting the "loop properties" from part 1
-  // (LP for Loop Properties)
-  auto &LP = FAM.getResult<LoopPropertiesAnalysis>(F);
-
   // yoink the dom tree analysis results
   auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
 
-  // When I first wrote this, there were so many nested loops, just really bad.
-  // My method to alleviate that is to create a map, where we map the depth value 
-  // to an llvm::SmallVector (or std::vector) of LoopProperties objects 
-  //
-  // It should be something like:
-  // { 1: [loop A, loop B, loop C]
-  //   2: [loop D, loop E]
-  //   ...
-  //   N: [loop Y, loop Z] }
-  //
-  // Ugly, ugly templating! The Keys to this map, as said before, are the depth
-  // values of the various loops (so integers). Each key will point to a vector
-  // of loops. This is so that we can iterate through the loops on a per-depth
-  // basis. Why do I care so much about depth? You will see later.
-  // 
-  // I would say this is the most C++ code I've ever seen, but I think I've 
-  // seen Kayvan write worse.
-  // ValueMap<int, SmallVector<LoopPropertiesAnalysis::LoopProperties*>> LPM;
-  DenseMap<int, SmallVector<LoopPropertiesAnalysis::LoopProperties*>> LPM;
-  for (auto L : LP) {
-    auto &entry = LPM.FindAndConstruct(L->depth);
-    entry.second.push_back(L);
-  }
+  // Per-block instruction kinds, so we can skip blocks with nothing to hoist
+  auto &BS = FAM.getResult<BlockSummaryAnalysis>(F);
 
-  // When we iterate through loops, we are going to analyze based on depth.
-  // We start with the deepest nested loop, and hoist into the next level up,
-  // then we got to that level, and so on until we reach the top level loops
-  // which have a depth of 0
-  //
-  // In other words consider:
-  // int x;
-  // while (true) {
-  //    while (true) {
-  //      x = 0;
-  //    }
-  // }
+  // We go through the blocks in reverse post order, which means that the
+  // definition of every operand is looked at before the instructions that use
+  // it. So by the time we get to an instruction, its operands have already
+  // been hoisted as far as they'll go, and one pass is enough.
   //
-  // `x = 0;` will first get hoisted by a single level of depth:
-  // int x;
-  // while (true) {
-  //    x = 0;
-  //    while (true) {
-  //    }
-  // }
-  // and then it will be hoisted out of the top level loop:
-  // int x;
-  // x = 0;
-  // while (true) {
-  //    while (true) {
-  //    }
-  // }
-  for (int currDepth = maxLoopDepth(LP); currDepth > -1; currDepth--) {
-    //errs() << "Analyzing loops of depth = " << currDepth << "\n";
-
-    SmallVector<Instruction*> hoist_victims;
-    
-    // Here, we are iterating all the LoopProperties objects that have a depth
-    // equal to currDepth, using the map that we created earlier
-    auto found = LPM.find(currDepth);
-
-    if(found == LPM.end()){
-        //errs() << "Couldn't find loop of depth: " << currDepth << '\n';
-        continue;
+  // The hoist_victims vector is an example of the "working list" concept
+  // Kayvan mentioned. If we try to edit basic blocks while parsing them,
+  // we're gonna have a bad time (don't ask how I know). So we collect the
+  // candidates first, and then go over the list and move things around.
+  SmallVector<Instruction*> hoist_victims;
+  ReversePostOrderTraversal<Function*> RPOT(&F);
+  for (auto &BB : RPOT) {
+    if (!LI.getLoopFor(BB) || !BS.has(BB, BlockSummaryAnalysis::Hoistable)) {
+      continue;
     }
-
-    for (auto &L : found->second) {
-      //errs() << "Current Loop:\n";
-      //L->print(errs());
-      //errs() << "\n";
-
-      // Iterate through all the basic blocks in the loop, L
-      for (auto &BB : L->loop->blocks()) {
-        
-        // Iterate through all instruction in basic block BB
-        for (auto &I : *BB) {
-          //errs() << "\tCurr inst: ";
-          //I.print(errs());
-          //errs() << "\n";
-
-          if (!isLoopInvariant(&I, LI) || !safeToHoist(&I, LI, DT)) {
-            continue;
-          }
-          
-          // If an instruction is both loop invariant and safe to move, put
-          // it either the parent of this loop, or if this is a top level
-          // loop (i.e. depth == 0), then put this instruction outside the loop
-          // entirely. "Hoist" is just the compiler jargin for lifting code
-          // outside the loop. You can think of it as, taking the code, and 
-          // carrying it upwards, outside the loop (hence, "hoist").
-          //errs() << "\tInstr added to hoisting queue!";
-          //errs() << "\n\n";
-          hoist_victims.push_back(&I);
-
-          // recompute Dominator Tree in the event we hoist.
-          //DT.recalculate(F);
-
-
-        }
-      }
-      //errs() << "\n";
+    for (auto &I : *BB) {
+      hoist_victims.push_back(&I);
     }
+  }
 
-    // The hoist_victims vector is an example of the "working list" concept
-    // Kayvan mentioned. If we try to edit basic blocks while parsing them,
-    // we're gonna have a bad time (don't ask how I know). So, we get a list
-    // of instructions that we know will be loop invariant, and then parse
-    // said list after we've looked at all the basic blocks we care about.
-    // The rest of the code in this loop is so that we can move the line of
-    // loop invariant code out of the loop.
-    //
-    // consider the following LLVM IR:
-    // 
-    // define i32 @main() #0 {        ; This is block zero
-    //   %1 = alloca i32, align 4
-    //   %2 = alloca i32, align 4
-    //   store i32 0, ptr %1, align 4
-    //   br label %3
-    //
-    // 3:                                                ; preds = %0, %3
-    //   store i32 1, ptr %2, align 4
-    //   br label %3, !llvm.loop !6
-    // }
-    //
-    // In general, we would want to move store i32 1, ptr %2, align 4 from
-    // block %3 to block %0.
-    // I know that for this assignment we ignore stores, but this is just a
-    // simple example that I think is fairly clear.
-    // So, in order to get to block %0, we get the Loop object containing
-    // block %3, then get the entry to said loop, and then from that, get the
-    // successor to the entry of the loop.
-    // That may have made zero sense.
-    // If that's the case, track me down to explain it irl.
-
-    bool hoisted = false;
-    for (auto &I : hoist_victims) {
-      auto L = LI.getLoopFor(I->getParent());
-      auto entry_block = L->getHeader()->getPrevNode();
-      I->removeFromParent();
-      I->insertBefore(&entry_block->back());
-      hoisted = true;
+  // Moving an instruction doesn't change the CFG, so LI and DT stay valid the
+  // whole time. The instruction goes right before the terminator of the
+  // target loop's preheader, after anything hoisted there before it (which
+  // includes its operands).
+  for (auto &I : hoist_victims) {
+    auto target = hoistTarget(I, LI, DT);
+    if (!target) {
+      continue;
     }
 
-    // redo this depth if there was hoisting happening
-    if (hoisted) {
-        currDepth++;
-    }
+    auto entry_block = target->getLoopPreheader();
+    BS.moveInstruction(*I, I->getParent(), entry_block);
+    I->removeFromParent();
+    I->insertBefore(&entry_block->back());
+  }
 
+  return PreservedAnalyses::all();
+}
 
-    //errs() << "\n";
+// Parses the optional "<max-instrs=N;max-deps=M>" suffix of the loop
+// distribution pass name, e.g.
+//   -passes='mp49774-an35288-loop-distribute-pass<max-instrs=64;max-deps=200>'
+static bool parseDistributionParams(StringRef Params, unsigned &MaxInstrs,
+                                    unsigned &MaxDeps) {
+  if (Params.empty()) {
+    return true;
+  }
+  if (!Params.consume_front("<") || !Params.consume_back(">")) {
+    return false;
   }
 
-  //errs() << "\nOutput IR of our pass:\n\n";
-  //F.print(errs());
-  //errs() << "\n\n";
+  while (!Params.empty()) {
+    StringRef Param;
+    std::tie(Param, Params) = Params.split(';');
 
-  return PreservedAnalyses::all();
+    StringRef Key, Value;
+    std::tie(Key, Value) = Param.split('=');
+
+    unsigned *Target = nullptr;
+    if (Key == "max-instrs") {
+      Target = &MaxInstrs;
+    }
+    else if (Key == "max-deps") {
+      Target = &MaxDeps;
+    }
+
+    if (!Target || Value.getAsInteger(10, *Target)) {
+      errs() << "invalid loop distribution parameter '" << Param << "'\n";
+      return false;
+    }
+  }
+  return true;
 }
 
 // New PM Registration
@@ -363,6 +299,16 @@ PassPluginLibraryInfo getLoopOptPassPluginInfo() {
                     FPM.addPass(LoopInvariantCodeMotion());
                     return true;
                   }
+                  if (Name.consume_front("mp49774-an35288-loop-distribute-pass")) {
+                    unsigned MaxInstrs = LoopDistribution::DefaultMaxInstrs;
+                    unsigned MaxDeps = LoopDistribution::DefaultMaxDeps;
+                    if (!parseDistributionParams(Name, MaxInstrs, MaxDeps)) {
+                      return false;
+                    }
+                    FPM.addPass(LoopSimplifyPass());
+                    FPM.addPass(LoopDistribution(MaxInstrs, MaxDeps));
+                    return true;
+                  }
                   return false;
                 });
           }};
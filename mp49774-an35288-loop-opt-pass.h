@@ -17,9 +17,11 @@ class LoopInvariantCodeMotion :
     public llvm::PassInfoMixin<LoopInvariantCodeMotion> {
 
 private:
-  bool isLoopInvariant(llvm::Instruction *I, const llvm::LoopInfo &LI);
-  bool safeToHoist(llvm::Instruction *I, const llvm::LoopInfo &LI, const llvm::DominatorTree &DT);
-  int maxLoopDepth(LoopPropertiesAnalysis::Result LP);
+  bool isLoopInvariant(llvm::Instruction *I, const llvm::Loop *L);
+  bool safeToHoist(llvm::Instruction *I, const llvm::BasicBlock *BB,
+                   const llvm::Loop *L, const llvm::DominatorTree &DT);
+  const llvm::Loop *hoistTarget(llvm::Instruction *I, const llvm::LoopInfo &LI,
+                                const llvm::DominatorTree &DT);
 
 public:
   // Main entry point, takes IR unit to run the pass on (&F) and the
@@ -32,4 +34,8 @@ public:
   static bool isRequired() { return true; }
 };
 
+// Plugin registration, exposed so tools can link the pass in directly instead
+// of going through -load-pass-plugin
+llvm::PassPluginLibraryInfo getLoopOptPassPluginInfo();
+
 #endif
@@ -0,0 +1,603 @@
+/*
+ * Streaming driver for huge bitcode modules.
+ *
+ * opt loads the whole module before running anything, which for multi-GB
+ * link-time modules means multi-GB of IR in memory. This tool instead
+ * memory-maps the bitcode and lets the BitcodeReader materialize one function
+ * body at a time. Every function gets the loop analysis and LICM run on it,
+ * is written out, and then has its body thrown away again, so peak memory
+ * follows the largest function rather than the module.
+ *
+ * An LLVM module can only be written out as a whole, so the output is a
+ * directory of shards instead of a single file:
+ *
+ *   <out>/globals.bc   global variables, aliases, ifuncs, module metadata and
+ *                      the functions those need a definition of
+ *   <out>/<N>.bc       one shard per remaining function definition (or per
+ *                      comdat, all members of a comdat go into one shard)
+ *   <out>/linkage.txt  the symbols whose linkage had to be changed, see below
+ *   <out>/shards.rsp   all of the above in module order, as a response file
+ *
+ * which `llvm-link @<out>/shards.rsp` puts back together. (Going through the
+ * response file rather than a glob keeps the functions in their original
+ * order and the command line short, there can be millions of shards.)
+ * Shards refer to each other by name, so symbols with local linkage are
+ * promoted to hidden external ones and unnamed ones are given a name.
+ * llvm-link also only pulls in linkonce and available_externally definitions
+ * when something in the destination still refers to them, so those get
+ * external linkage in the shards as well.
+ *
+ * Every shard with debug info needs a DICompileUnit of its own, and llvm-link
+ * has no way of telling that they're all copies of the same one. So the shards
+ * only get a stripped-down copy of the unit (no enums, globals, imports...),
+ * and running the linked module through `loop-stream -restore=<out>/linkage.txt`
+ * merges those back into the real units from globals.bc, on top of putting
+ * the original linkage back.
+ *
+ * Usage:
+ *   loop-stream input.bc -o out-dir [-passes=<function pipeline>]
+ *   loop-stream linked.bc -restore=out-dir/linkage.txt -o output.bc
+ */
+#include <llvm/ADT/MapVector.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Comdat.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/LineIterator.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/ToolOutputFile.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include "mp49774-an35288-loop-analysis-pass.h"
+#include "mp49774-an35288-loop-opt-pass.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::Required,
+                                          cl::desc("<input bitcode>"));
+
+static cl::opt<std::string> OutputDir(
+    "o", cl::Required,
+    cl::desc("Output directory for the shards (output file with -restore)"),
+    cl::value_desc("path"));
+
+static cl::opt<std::string> Passes(
+    "passes",
+    cl::desc("Function pipeline to run on every function"),
+    cl::init("mp49774-an35288-loop-analysis-pass,mp49774-an35288-loop-opt-pass"));
+
+static cl::opt<bool> VerifyShards("verify-shards",
+                                  cl::desc("Run the verifier on every shard"),
+                                  cl::init(false));
+
+static cl::opt<std::string> RestoreManifest(
+    "restore",
+    cl::desc("Undo the linkage changes listed in the manifest on an already "
+             "linked module instead of splitting one"),
+    cl::value_desc("linkage.txt"));
+
+static ExitOnError ExitOnErr;
+
+namespace {
+
+// Fills in declarations for every global a cloned function body refers to.
+// The definitions live in some other shard.
+class DeclarationMaterializer : public ValueMaterializer {
+  Module &Dest;
+
+public:
+  DeclarationMaterializer(Module &Dest) : Dest(Dest) {}
+
+  Value *materialize(Value *V) override {
+    auto *GV = dyn_cast<GlobalValue>(V);
+    if (!GV) {
+      return nullptr;
+    }
+
+    if (auto *F = dyn_cast<Function>(GV)) {
+      auto *Decl = Function::Create(F->getFunctionType(),
+                                    GlobalValue::ExternalLinkage,
+                                    F->getAddressSpace(), F->getName(), &Dest);
+      Decl->setAttributes(F->getAttributes());
+      Decl->setVisibility(F->getVisibility());
+      Decl->setCallingConv(F->getCallingConv());
+      return Decl;
+    }
+
+    // Variables, and aliases to them, turn into external variables.
+    // Aliases to functions come out as plain function declarations.
+    if (auto *FT = dyn_cast<FunctionType>(GV->getValueType())) {
+      return Function::Create(FT, GlobalValue::ExternalLinkage,
+                              GV->getAddressSpace(), GV->getName(), &Dest);
+    }
+    auto *Var = dyn_cast<GlobalVariable>(GV);
+    auto *Decl = new GlobalVariable(
+        Dest, GV->getValueType(), Var && Var->isConstant(),
+        GlobalValue::ExternalLinkage, nullptr, GV->getName(), nullptr,
+        GV->getThreadLocalMode(), GV->getAddressSpace());
+    Decl->setVisibility(GV->getVisibility());
+    return Decl;
+  }
+};
+
+}
+
+static void writeShard(const Module &M, StringRef Name) {
+  SmallString<128> Path(OutputDir);
+  sys::path::append(Path, Name);
+
+  if (VerifyShards && verifyModule(M, &errs())) {
+    ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                "shard " + Path + " is broken"));
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(Path, EC, sys::fs::OF_None);
+  if (EC) {
+    ExitOnErr(errorCodeToError(EC));
+  }
+  WriteBitcodeToFile(M, Out.os());
+  Out.keep();
+}
+
+// The linkages we have to change, and how they're spelled in the manifest
+static const std::pair<GlobalValue::LinkageTypes, StringRef> PromotedLinkages[] = {
+    {GlobalValue::InternalLinkage, "internal"},
+    {GlobalValue::PrivateLinkage, "private"},
+    {GlobalValue::LinkOnceAnyLinkage, "linkonce"},
+    {GlobalValue::LinkOnceODRLinkage, "linkonce_odr"},
+    {GlobalValue::AvailableExternallyLinkage, "available_externally"},
+};
+
+static void writeTextFile(StringRef Name, StringRef Contents) {
+  SmallString<128> Path(OutputDir);
+  sys::path::append(Path, Name);
+
+  std::error_code EC;
+  ToolOutputFile Out(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    ExitOnErr(errorCodeToError(EC));
+  }
+  Out.os() << Contents;
+  Out.keep();
+}
+
+// Local symbols can't be referenced from another module, so everything that
+// might be needs a (still hidden) external name. Lazily linked definitions
+// would get dropped by llvm-link, so they become external too. Every change
+// goes into the manifest as "<old linkage> <was unnamed> <name>" so -restore
+// can undo it. The manifest starts with the module's source file name, which
+// llvm-link replaces, and the number of compile units the module had, which
+// -restore needs to tell the real ones from the shards'.
+// This only touches the headers of the globals, none of the bodies have to be
+// loaded for it.
+static void promoteLinkage(Module &M) {
+  std::string Manifest;
+  raw_string_ostream OS(Manifest);
+
+  auto *CUs = M.getNamedMetadata("llvm.dbg.cu");
+  OS << "source-filename " << M.getSourceFileName() << "\n";
+  OS << "compile-units " << (CUs ? CUs->getNumOperands() : 0) << "\n";
+
+  for (auto &GV : M.global_values()) {
+    bool Unnamed = !GV.hasName();
+    auto It = llvm::find_if(PromotedLinkages, [&](const auto &Entry) {
+      return Entry.first == GV.getLinkage();
+    });
+    if (!Unnamed && It == std::end(PromotedLinkages)) {
+      continue;
+    }
+
+    if (Unnamed) {
+      GV.setName("__loop_stream_anon");
+    }
+    if (It != std::end(PromotedLinkages)) {
+      OS << It->second;
+      bool Local = GV.hasLocalLinkage();
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+      if (Local) {
+        GV.setVisibility(GlobalValue::HiddenVisibility);
+      }
+    }
+    else {
+      OS << "-";
+    }
+    OS << " " << Unnamed << " " << GV.getName() << "\n";
+  }
+
+  writeTextFile("linkage.txt", OS.str());
+}
+
+// The other half of promoteLinkage, run on the module llvm-link put back
+// together. Returns how many compile units the original module had.
+static unsigned restoreLinkage(Module &M, const MemoryBuffer &Manifest) {
+  unsigned NumUnits = 0;
+  for (line_iterator Line(Manifest); !Line.is_at_eof(); ++Line) {
+    StringRef Linkage, Unnamed, Name;
+    std::tie(Linkage, Name) = Line->split(' ');
+    if (Linkage == "source-filename") {
+      M.setSourceFileName(Name);
+      continue;
+    }
+    if (Linkage == "compile-units") {
+      if (Name.getAsInteger(10, NumUnits)) {
+        ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                    "bad compile unit count in manifest"));
+      }
+      continue;
+    }
+    std::tie(Unnamed, Name) = Name.split(' ');
+
+    auto *GV = M.getNamedValue(Name);
+    if (!GV) {
+      errs() << "warning: " << Name << " is missing from the linked module\n";
+      continue;
+    }
+
+    if (Linkage != "-") {
+      auto It = llvm::find_if(PromotedLinkages, [&](const auto &Entry) {
+        return Entry.second == Linkage;
+      });
+      if (It == std::end(PromotedLinkages)) {
+        ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                    "bad linkage '" + Linkage + "' in manifest"));
+      }
+      // Going back to a local linkage resets the visibility as well
+      GV->setLinkage(It->first);
+    }
+    if (Unnamed == "1") {
+      GV->setName("");
+    }
+  }
+  return NumUnits;
+}
+
+// The shards' stripped-down copy of CU, see cloneIntoShard
+static DICompileUnit *shardUnit(const DICompileUnit *CU) {
+  auto Temp = CU->clone();
+  Temp->replaceEnumTypes(nullptr);
+  Temp->replaceRetainedTypes(nullptr);
+  Temp->replaceGlobalVariables(nullptr);
+  Temp->replaceImportedEntities(nullptr);
+  Temp->replaceMacros(nullptr);
+  return MDNode::replaceWithDistinct(std::move(Temp));
+}
+
+// Whether Copy is a shard's copy of Orig. That's everything shardUnit keeps.
+static bool isCopyOf(const DICompileUnit *Copy, const DICompileUnit *Orig) {
+  return Copy->getFile() == Orig->getFile() &&
+         Copy->getSourceLanguage() == Orig->getSourceLanguage() &&
+         Copy->getProducer() == Orig->getProducer() &&
+         Copy->isOptimized() == Orig->isOptimized() &&
+         Copy->getFlags() == Orig->getFlags() &&
+         Copy->getRuntimeVersion() == Orig->getRuntimeVersion() &&
+         Copy->getSplitDebugFilename() == Orig->getSplitDebugFilename() &&
+         Copy->getEmissionKind() == Orig->getEmissionKind() &&
+         Copy->getDWOId() == Orig->getDWOId() &&
+         Copy->getSplitDebugInlining() == Orig->getSplitDebugInlining() &&
+         Copy->getDebugInfoForProfiling() == Orig->getDebugInfoForProfiling() &&
+         Copy->getNameTableKind() == Orig->getNameTableKind() &&
+         Copy->getRangesBaseAddress() == Orig->getRangesBaseAddress() &&
+         Copy->getSysRoot() == Orig->getSysRoot() &&
+         Copy->getSDK() == Orig->getSDK();
+}
+
+// llvm-link keeps every shard's compile unit, after the NumUnits real ones from
+// globals.bc (which is linked first). Points every subprogram back at the real
+// unit and drops the copies from llvm.dbg.cu.
+static void mergeCompileUnits(Module &M, unsigned NumUnits) {
+  auto *CUs = M.getNamedMetadata("llvm.dbg.cu");
+  if (!CUs || CUs->getNumOperands() <= NumUnits) {
+    return;
+  }
+
+  SmallVector<DICompileUnit*, 4> Originals;
+  for (unsigned i = 0; i < NumUnits; i++) {
+    Originals.push_back(cast<DICompileUnit>(CUs->getOperand(i)));
+  }
+
+  // Anything that doesn't match one of the originals stays as it is
+  SmallVector<DICompileUnit*, 4> Units = Originals;
+  DenseMap<DICompileUnit*, DICompileUnit*> Merged;
+  for (unsigned i = NumUnits; i < CUs->getNumOperands(); i++) {
+    auto *CU = cast<DICompileUnit>(CUs->getOperand(i));
+    auto It = llvm::find_if(Originals, [&](DICompileUnit *Orig) {
+      return isCopyOf(CU, Orig);
+    });
+    if (It != Originals.end()) {
+      Merged[CU] = *It;
+    }
+    else {
+      Units.push_back(CU);
+    }
+  }
+
+  DebugInfoFinder Finder;
+  Finder.processModule(M);
+  for (auto *SP : Finder.subprograms()) {
+    if (auto *Orig = Merged.lookup(SP->getUnit())) {
+      SP->replaceUnit(Orig);
+    }
+  }
+
+  CUs->clearOperands();
+  for (auto *CU : Units) {
+    CUs->addOperand(CU);
+  }
+}
+
+static int restore() {
+  auto Manifest = ExitOnErr(errorOrToExpected(
+      MemoryBuffer::getFile(RestoreManifest, /*IsText=*/true)));
+
+  LLVMContext Ctx;
+  auto Buffer = ExitOnErr(errorOrToExpected(MemoryBuffer::getFile(InputFilename)));
+  std::unique_ptr<Module> M =
+      ExitOnErr(parseBitcodeFile(Buffer->getMemBufferRef(), Ctx));
+
+  unsigned NumUnits = restoreLinkage(*M, *Manifest);
+  mergeCompileUnits(*M, NumUnits);
+  if (verifyModule(*M, &errs())) {
+    ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                "restored module is broken"));
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputDir, EC, sys::fs::OF_None);
+  if (EC) {
+    ExitOnErr(errorCodeToError(EC));
+  }
+  WriteBitcodeToFile(*M, Out.os());
+  Out.keep();
+  return 0;
+}
+
+// Function definitions that have to share a shard because they're in the same
+// comdat, in module order
+using ComdatGroups = MapVector<const Comdat*, SmallVector<Function*, 2>>;
+
+static ComdatGroups comdatGroups(Module &M) {
+  ComdatGroups Groups;
+  for (auto &F : M) {
+    if (auto *C = F.getComdat(); C && !F.isDeclaration()) {
+      Groups[C].push_back(&F);
+    }
+  }
+  return Groups;
+}
+
+// Aliases and ifuncs have to sit in the same module as the function they
+// point at, so those functions go into the globals shard with them. So do
+// functions sharing a comdat with anything that lives there.
+static SmallPtrSet<Function*, 8> pinnedFunctions(Module &M,
+                                                 const ComdatGroups &Groups) {
+  SmallPtrSet<Function*, 8> Pinned;
+  for (auto &GA : M.aliases()) {
+    if (auto *F = dyn_cast_or_null<Function>(GA.getAliaseeObject())) {
+      Pinned.insert(F);
+    }
+  }
+  for (auto &GI : M.ifuncs()) {
+    if (auto *F = GI.getResolverFunction()) {
+      Pinned.insert(F);
+    }
+  }
+
+  SmallPtrSet<const Comdat*, 8> GlobalComdats;
+  for (auto &GV : M.global_values()) {
+    auto *F = dyn_cast<Function>(&GV);
+    if (GV.getComdat() && (!F || Pinned.count(F))) {
+      GlobalComdats.insert(GV.getComdat());
+    }
+  }
+  for (auto *C : GlobalComdats) {
+    auto It = Groups.find(C);
+    if (It != Groups.end()) {
+      Pinned.insert(It->second.begin(), It->second.end());
+    }
+  }
+  return Pinned;
+}
+
+// Copies Fs (already optimized) into a fresh module of their own. Units maps
+// the module's compile units to the copies the shards get instead.
+static std::unique_ptr<Module> cloneIntoShard(
+    ArrayRef<Function*> Fs,
+    ArrayRef<std::pair<DICompileUnit*, DICompileUnit*>> Units) {
+  Module &M = *Fs.front()->getParent();
+  auto Shard = std::make_unique<Module>(Fs.front()->getName(), M.getContext());
+  Shard->setSourceFileName(M.getSourceFileName());
+  Shard->setDataLayout(M.getDataLayout());
+  Shard->setTargetTriple(M.getTargetTriple());
+
+  SmallVector<Module::ModuleFlagEntry, 8> Flags;
+  M.getModuleFlagsMetadata(Flags);
+  for (auto &Flag : Flags) {
+    Shard->addModuleFlag(Flag.Behavior, Flag.Key->getString(), Flag.Val);
+  }
+
+  // Create all of them before cloning any bodies, so calls between them map
+  // to the definitions rather than to fresh declarations
+  ValueToValueMapTy VMap;
+  for (auto &Unit : Units) {
+    VMap.MD()[Unit.first].reset(Unit.second);
+  }
+  for (auto *F : Fs) {
+    auto *NewF = Function::Create(F->getFunctionType(), F->getLinkage(),
+                                  F->getAddressSpace(), F->getName(), Shard.get());
+    if (auto *C = F->getComdat()) {
+      auto *NewC = Shard->getOrInsertComdat(C->getName());
+      NewC->setSelectionKind(C->getSelectionKind());
+      NewF->setComdat(NewC);
+    }
+
+    VMap[F] = NewF;
+    auto DestArg = NewF->arg_begin();
+    for (auto &Arg : F->args()) {
+      DestArg->setName(Arg.getName());
+      VMap[&Arg] = &*DestArg++;
+    }
+  }
+
+  DeclarationMaterializer Materializer(*Shard);
+  for (auto *F : Fs) {
+    SmallVector<ReturnInst*, 8> Returns;
+    CloneFunctionInto(cast<Function>(VMap[F]), F, VMap,
+                      CloneFunctionChangeType::DifferentModule, Returns, "",
+                      nullptr, nullptr, &Materializer);
+  }
+
+  // CloneFunctionInto adds llvm.dbg.cu even when there's no debug info, and
+  // an empty one makes the bitcode reader complain about the missing version
+  auto *CUs = Shard->getNamedMetadata("llvm.dbg.cu");
+  if (CUs && CUs->getNumOperands() == 0) {
+    Shard->eraseNamedMetadata(CUs);
+  }
+  return Shard;
+}
+
+// Done with F for good: drop the body and anything the analyses still
+// remember about it
+static void dematerialize(Function &F, FunctionAnalysisManager &FAM) {
+  FAM.clear(F, F.getName());
+  F.deleteBody();
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "streaming loop analysis + LICM\n");
+  ExitOnErr.setBanner(std::string(argv[0]) + ": ");
+
+  if (!RestoreManifest.empty()) {
+    return restore();
+  }
+
+  // Not asking for a null terminator is what lets MemoryBuffer mmap the file
+  // rather than read it into memory
+  auto Buffer = MemoryBuffer::getFile(InputFilename, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+  if (!Buffer) {
+    ExitOnErr(errorCodeToError(Buffer.getError()));
+  }
+
+  LLVMContext Ctx;
+  std::unique_ptr<Module> M = ExitOnErr(getOwningLazyBitcodeModule(
+      std::move(*Buffer), Ctx, /*ShouldLazyLoadMetadata=*/true));
+  ExitOnErr(M->materializeMetadata());
+
+  if (auto EC = sys::fs::create_directories(OutputDir)) {
+    ExitOnErr(errorCodeToError(EC));
+  }
+
+  // Same setup opt does, with our two plugins linked in rather than loaded
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+
+  getLoopAnalysisPluginInfo().RegisterPassBuilderCallbacks(PB);
+  getLoopOptPassPluginInfo().RegisterPassBuilderCallbacks(PB);
+
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  FunctionPassManager FPM;
+  ExitOnErr(PB.parsePassPipeline(FPM, Passes));
+
+  promoteLinkage(*M);
+
+  // Functions the globals shard needs a body for get optimized first and
+  // then stay loaded until that shard is out
+  auto Groups = comdatGroups(*M);
+  auto Pinned = pinnedFunctions(*M, Groups);
+  for (auto *F : Pinned) {
+    ExitOnErr(F->materialize());
+    FPM.run(*F, FAM);
+  }
+
+  ValueToValueMapTy VMap;
+  auto Globals = CloneModule(*M, VMap, [&](const GlobalValue *GV) {
+    auto *F = dyn_cast<Function>(GV);
+    return !F || Pinned.count(const_cast<Function*>(F));
+  });
+  writeShard(*Globals, "globals.bc");
+  Globals.reset();
+
+  for (auto *F : Pinned) {
+    dematerialize(*F, FAM);
+  }
+
+  SmallVector<std::pair<DICompileUnit*, DICompileUnit*>, 4> Units;
+  for (auto *CU : M->debug_compile_units()) {
+    Units.push_back({CU, shardUnit(CU)});
+  }
+
+  // The response file for llvm-link, with absolute paths so it works from
+  // anywhere
+  std::string Shards;
+  raw_string_ostream ShardList(Shards);
+  auto addToShardList = [&](StringRef Name) {
+    SmallString<128> Path(OutputDir);
+    sys::path::append(Path, Name);
+    if (auto EC = sys::fs::make_absolute(Path)) {
+      ExitOnErr(errorCodeToError(EC));
+    }
+    sys::printArg(ShardList, Path, /*Quote=*/true);
+    ShardList << "\n";
+  };
+  addToShardList("globals.bc");
+
+  unsigned ShardID = 0;
+  for (auto &F : *M) {
+    // Still-unmaterialized bodies don't count as declarations, so this only
+    // skips real ones (and the pinned functions we already emptied)
+    if (F.isDeclaration()) {
+      continue;
+    }
+
+    // A comdat goes out as a whole when we reach its first member, which
+    // leaves the rest of them as declarations by the time we get there
+    SmallVector<Function*, 2> Fs;
+    if (auto *C = F.getComdat()) {
+      Fs = Groups.lookup(C);
+    }
+    else {
+      Fs.push_back(&F);
+    }
+
+    for (auto *G : Fs) {
+      ExitOnErr(G->materialize());
+      FPM.run(*G, FAM);
+    }
+
+    auto Shard = cloneIntoShard(Fs, Units);
+    auto Name = std::to_string(ShardID++) + ".bc";
+    writeShard(*Shard, Name);
+    addToShardList(Name);
+    Shard.reset();
+
+    for (auto *G : Fs) {
+      dematerialize(*G, FAM);
+    }
+  }
+
+  writeTextFile("shards.rsp", ShardList.str());
+  return 0;
+}
@@ -0,0 +1,22 @@
+#include <atomic>
+
+std::atomic<int> hits(0);
+
+// The sum is needed after the loop, so the counter has to get its own loop
+// in front of the summing one rather than after it.
+int sum(const int *__restrict a, int n) {
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        s += a[i];
+        hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    return s;
+}
+
+int main() {
+    int a[64];
+    for (int i = 0; i < 64; i++) {
+        a[i] = i;
+    }
+    return sum(a, 64) + hits.load();
+}
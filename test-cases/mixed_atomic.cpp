@@ -0,0 +1,22 @@
+#include <atomic>
+
+std::atomic<int> hits(0);
+
+// The array update can be vectorized, the counter can't. After loop
+// distribution they should end up in two separate loops.
+void scale(int *__restrict a, const int *__restrict b, int n) {
+    for (int i = 0; i < n; i++) {
+        a[i] = b[i] * 2;
+        hits.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+int main() {
+    int a[64];
+    int b[64];
+    for (int i = 0; i < 64; i++) {
+        b[i] = i;
+    }
+    scale(a, b, 64);
+    return a[63] + hits.load();
+}
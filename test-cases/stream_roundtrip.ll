@@ -0,0 +1,86 @@
+$pair = comdat any
+
+@counter = internal global i32 0, !dbg !20
+@table = linkonce_odr global i32 7
+
+define linkonce_odr i32 @f1(i32 %x) !dbg !10 {
+entry:
+  call void @llvm.dbg.value(metadata i32 %x, metadata !14, metadata !DIExpression()), !dbg !15
+  %r = add i32 %x, 1, !dbg !15
+  ret i32 %r, !dbg !15
+}
+
+define linkonce_odr i32 @pair_a(i32 %x) comdat($pair) {
+entry:
+  %r = call i32 @pair_b(i32 %x)
+  ret i32 %r
+}
+
+define linkonce_odr i32 @pair_b(i32 %x) comdat($pair) {
+entry:
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+define internal i32 @helper(i32 %x) {
+entry:
+  %r = call i32 @0(i32 %x)
+  ret i32 %r
+}
+
+define private i32 @0(i32 %x) {
+entry:
+  %r = sub i32 %x, 2
+  ret i32 %r
+}
+
+define available_externally i32 @ae(i32 %x) {
+entry:
+  ret i32 %x
+}
+
+define i32 @main(i32 %n) !dbg !16 {
+entry:
+  br label %loop, !dbg !17
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  %inv = mul i32 %n, 5, !dbg !18
+  %v = add i32 %acc, %inv, !dbg !18
+  %acc.next = add i32 %v, %i, !dbg !18
+  %i.next = add i32 %i, 1, !dbg !18
+  %c = icmp slt i32 %i.next, %n, !dbg !18
+  br i1 %c, label %loop, label %exit, !dbg !18
+
+exit:
+  %a = call i32 @pair_a(i32 %acc.next), !dbg !19
+  %b = call i32 @helper(i32 %a), !dbg !19
+  %d = call i32 @ae(i32 %b), !dbg !19
+  %e = call i32 @f1(i32 %d), !dbg !19
+  ret i32 %e, !dbg !19
+}
+
+declare void @llvm.dbg.value(metadata, metadata, metadata)
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!2, !3}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C_plus_plus_14, file: !1, producer: "clang", isOptimized: false, runtimeVersion: 0, emissionKind: FullDebug, globals: !21)
+!1 = !DIFile(filename: "stream_roundtrip.cpp", directory: "/tmp")
+!2 = !{i32 7, !"Dwarf Version", i32 5}
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!10 = distinct !DISubprogram(name: "f1", scope: !1, file: !1, line: 1, type: !11, scopeLine: 1, spFlags: DISPFlagDefinition, unit: !0, retainedNodes: !13)
+!11 = !DISubroutineType(types: !12)
+!12 = !{!22, !22}
+!13 = !{!14}
+!14 = !DILocalVariable(name: "x", arg: 1, scope: !10, file: !1, line: 1, type: !22)
+!15 = !DILocation(line: 2, column: 3, scope: !10)
+!16 = distinct !DISubprogram(name: "main", scope: !1, file: !1, line: 5, type: !11, scopeLine: 5, spFlags: DISPFlagDefinition, unit: !0)
+!17 = !DILocation(line: 6, column: 3, scope: !16)
+!18 = !DILocation(line: 7, column: 5, scope: !16)
+!19 = !DILocation(line: 9, column: 3, scope: !16)
+!20 = !DIGlobalVariableExpression(var: !23, expr: !DIExpression())
+!21 = !{!20}
+!22 = !DIBasicType(name: "int", size: 32, encoding: DW_ATE_signed)
+!23 = distinct !DIGlobalVariable(name: "counter", scope: !0, file: !1, line: 3, type: !22, isLocal: true, isDefinition: true)
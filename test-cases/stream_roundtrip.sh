@@ -0,0 +1,54 @@
+#!/bin/bash
+
+# Round trip through loop-stream: split test-cases/stream_roundtrip.ll into
+# shards, link them back together, restore the original linkage and check that
+# every function (and the module-level globals and metadata) comes out exactly
+# like opt running the same pipeline on the whole module.
+#
+# Usage (assuming running from cwd=build): ../test-cases/stream_roundtrip.sh [build-dir]
+# The build directory needs loop-stream and both plugins. The LLVM tools can
+# be overridden with LLVM_AS, LLVM_LINK, LLVM_DIS and OPT.
+
+set -e
+
+BUILD=${1:-.}
+LLVM_AS=${LLVM_AS:-llvm-as}
+LLVM_LINK=${LLVM_LINK:-llvm-link}
+LLVM_DIS=${LLVM_DIS:-llvm-dis}
+OPT=${OPT:-opt}
+PASSES="mp49774-an35288-loop-analysis-pass,mp49774-an35288-loop-opt-pass"
+
+INPUT="$(dirname "$0")/stream_roundtrip.ll"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Prefixes every line with the function it belongs to ("@" for module-level
+# lines) and sorts by that, so the order functions end up in doesn't matter
+# but everything inside of them does
+canonical() {
+    awk '
+        /^;/ || /^$/ { next }
+        /^(define|declare) / { match($0, /@[^(]*\(/); fn = substr($0, RSTART, RLENGTH - 1) }
+        { print (fn == "" ? "@" : fn) "\t" $0 }
+        /^declare / || /^}/ { fn = "" }
+    ' "$1" | LC_ALL=C sort -s -t "	" -k1,1
+}
+
+"$LLVM_AS" "$INPUT" -o "$WORK/in.bc"
+"$OPT" -load-pass-plugin "$BUILD/libloop-analysis-pass.so" \
+       -load-pass-plugin "$BUILD/libloop-opt-pass.so" \
+       -passes="$PASSES" "$WORK/in.bc" -o "$WORK/ref.bc" 2> /dev/null
+
+"$BUILD/loop-stream" "$WORK/in.bc" -o "$WORK/shards" -passes="$PASSES" -verify-shards 2> /dev/null
+"$LLVM_LINK" @"$WORK/shards/shards.rsp" -o "$WORK/linked.bc"
+"$BUILD/loop-stream" "$WORK/linked.bc" -restore="$WORK/shards/linkage.txt" -o "$WORK/out.bc"
+
+"$LLVM_DIS" "$WORK/ref.bc" -o "$WORK/ref.ll"
+"$LLVM_DIS" "$WORK/out.bc" -o "$WORK/out.ll"
+
+if diff -u <(canonical "$WORK/ref.ll") <(canonical "$WORK/out.ll"); then
+    echo "loop-stream round trip OK"
+else
+    echo "loop-stream round trip doesn't match opt"
+    exit 1
+fi